@@ -0,0 +1,96 @@
+/* Bandwidth limits based on token buckets.
+ *
+ * Every transfer loop calls bw_throttle() with the number of bytes it has just
+ * moved, and sleeps when its class of traffic (scp or tunnels) exceeds its rate
+ * limit. Limits are per process: transfers in other R processes are not counted. */
+
+#include <unistd.h>
+#include "myssh.h"
+
+/* Max burst in seconds worth of tokens */
+#define BW_BURST 0.1
+
+/* Longer gaps between chunks are idle time, not transfer time */
+#define BW_IDLE 1.0
+
+typedef struct {
+  double rate;
+  double tokens;
+  double updated;
+  double bytes;
+  double seconds;
+  double last;
+} bw_bucket;
+
+static const char * bw_names[BW_CLASSES] = {"bulk", "interactive"};
+static bw_bucket bw_class[BW_CLASSES];
+
+static void bw_refill(bw_bucket *bucket, double now){
+  bucket->tokens += (now - bucket->updated) * bucket->rate;
+  if(bucket->tokens > bucket->rate * BW_BURST)
+    bucket->tokens = bucket->rate * BW_BURST;
+  bucket->updated = now;
+}
+
+void bw_throttle(int cls, size_t bytes){
+  if(bytes == 0)
+    return;
+  double now = current_time();
+  bw_bucket *bucket = &bw_class[cls];
+  if(bucket->last > 0 && now - bucket->last < BW_IDLE)
+    bucket->seconds += now - bucket->last;
+  bucket->bytes += bytes;
+  bucket->last = now;
+  if(bucket->rate == 0)
+    return;
+  bw_refill(bucket, now);
+  bucket->tokens -= bytes;
+
+  /* seconds until the bucket is out of debt */
+  double wait = bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+  while(wait > 0 && !pending_interrupt()){
+    double step = wait < 0.1 ? wait : 0.1;
+    usleep(step * 1e6);
+    wait -= step;
+  }
+  /* throttled time counts as transfer time */
+  now = current_time();
+  bucket->seconds += now - bucket->last;
+  bucket->last = now;
+}
+
+static void bw_set(bw_bucket *bucket, SEXP rate){
+  double val = Rf_asReal(rate);
+  bucket->rate = R_finite(val) && val > 0 ? val : 0;
+  bucket->tokens = bucket->rate * BW_BURST;
+  bucket->updated = current_time();
+}
+
+SEXP C_bandwidth_limit(SEXP bulk, SEXP interactive){
+  bw_set(&bw_class[BW_BULK], bulk);
+  bw_set(&bw_class[BW_INTERACTIVE], interactive);
+  return R_NilValue;
+}
+
+SEXP C_bandwidth_stats(SEXP reset){
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, BW_CLASSES));
+  SEXP limit = PROTECT(Rf_allocVector(REALSXP, BW_CLASSES));
+  SEXP bytes = PROTECT(Rf_allocVector(REALSXP, BW_CLASSES));
+  SEXP seconds = PROTECT(Rf_allocVector(REALSXP, BW_CLASSES));
+  for(int i = 0; i < BW_CLASSES; i++){
+    bw_bucket *bucket = &bw_class[i];
+    SET_STRING_ELT(names, i, Rf_mkChar(bw_names[i]));
+    REAL(limit)[i] = bucket->rate > 0 ? bucket->rate : R_PosInf;
+    REAL(bytes)[i] = bucket->bytes;
+    REAL(seconds)[i] = bucket->seconds;
+    if(Rf_asLogical(reset))
+      bucket->bytes = bucket->seconds = bucket->last = 0;
+  }
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(out, 0, names);
+  SET_VECTOR_ELT(out, 1, limit);
+  SET_VECTOR_ELT(out, 2, bytes);
+  SET_VECTOR_ELT(out, 3, seconds);
+  UNPROTECT(5);
+  return out;
+}
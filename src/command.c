@@ -1,3 +1,4 @@
+#include <unistd.h>
 #include "myssh.h"
 
 void assert_channel(int rc, const char * what, ssh_channel channel){
@@ -20,6 +21,33 @@ static void R_callback(SEXP fun, const char * buf, ssize_t len){
   UNPROTECT(2);
 }
 
+/* Evaluates a callback and returns its value. If it raised an error, sets 'failed' and
+ * returns the condition, or R_NilValue when the callback was interrupted. */
+SEXP try_callback(SEXP call, int *failed){
+  SEXP expr = PROTECT(Rf_lang2(Rf_install("list"), call));
+  SEXP trycall = PROTECT(Rf_lang3(Rf_install("tryCatch"), expr, Rf_install("identity")));
+  SET_TAG(CDDR(trycall), Rf_install("error"));
+  SEXP res = R_tryEval(trycall, R_BaseEnv, failed);
+  if(*failed){
+    res = R_NilValue;
+  } else if(Rf_inherits(res, "error")){
+    *failed = 1;
+  } else {
+    res = VECTOR_ELT(res, 0);
+  }
+  UNPROTECT(2);
+  return res;
+}
+
+/* Re-raises the condition from try_callback() after the caller has cleaned up */
+void raise_callback_error(SEXP cond, const char * what){
+  if(cond == R_NilValue)
+    Rf_errorcall(R_NilValue, "%s was interrupted", what);
+  SEXP call = PROTECT(Rf_lang2(Rf_install("stop"), cond));
+  Rf_eval(call, R_BaseEnv);
+  UNPROTECT(1);
+}
+
 /* Set up tunnel to the target host */
 SEXP C_ssh_exec(SEXP ptr, SEXP command, SEXP outfun, SEXP errfun){
   ssh_session ssh = ssh_ptr_get(ptr);
@@ -53,3 +81,205 @@ cleanup:
   ssh_channel_free(channel);
   return Rf_ScalarInteger(status);
 }
+
+/* Follow remote logs on one or more sessions. Output is split into lines in C
+ * and delivered to R in batches of at most 'max_lines', at most once per
+ * 'interval' seconds. When a batch is full we stop reading, such that the ssh
+ * flow control throttles the remote end instead of buffering without limit. */
+typedef struct {
+  ssh_channel channel;
+  char * buf;
+  size_t len;
+  size_t size;
+  double received;
+} tail_stream;
+
+static void close_streams(tail_stream * streams, int n){
+  for(int i = 0; i < n; i++){
+    if(streams[i].channel){
+      ssh_channel_close(streams[i].channel);
+      ssh_channel_free(streams[i].channel);
+      streams[i].channel = NULL;
+    }
+    free(streams[i].buf);
+    streams[i].buf = NULL;
+  }
+}
+
+/* Make room for the next read in the (reusable) line buffer; returns -1 if out of memory */
+static int tail_grow(tail_stream * stream){
+  if(stream->size - stream->len < 16384){
+    size_t size = 2 * stream->size + 16384;
+    char * buf = realloc(stream->buf, size);
+    if(buf == NULL)
+      return -1;
+    stream->buf = buf;
+    stream->size = size;
+  }
+  return 0;
+}
+
+/* Read available data into the line buffer of the stream */
+static int tail_read(tail_stream * stream){
+  int nbytes = ssh_channel_read_nonblocking(stream->channel, stream->buf + stream->len, stream->size - stream->len, 0);
+  if(nbytes > 0){
+    stream->len += nbytes;
+    stream->received = current_time();
+  }
+  static char errbuf[1024];
+  int errbytes;
+  while((errbytes = ssh_channel_read_nonblocking(stream->channel, errbuf, sizeof(errbuf), 1)) > 0)
+    REprintf("%.*s", errbytes, errbuf);
+  return nbytes;
+}
+
+/* Remote logs are usually UTF-8, but may contain anything */
+static int valid_utf8(const unsigned char * s, size_t len){
+  size_t i = 0;
+  while(i < len){
+    int follow = s[i] < 0x80 ? 0 : (s[i] & 0xE0) == 0xC0 ? 1 : (s[i] & 0xF0) == 0xE0 ? 2 : (s[i] & 0xF8) == 0xF0 ? 3 : -1;
+    if(follow < 0 || len - i <= (size_t) follow)
+      return 0;
+    for(int j = 1; j <= follow; j++){
+      if((s[i + j] & 0xC0) != 0x80)
+        return 0;
+    }
+    i += follow + 1;
+  }
+  return 1;
+}
+
+/* Move complete lines into the batch; at eof also the final unterminated line.
+ * Lines that are not valid UTF-8 are marked as "bytes" and NUL bytes become '?'. */
+static int tail_lines(tail_stream * stream, SEXP host, SEXP hosts, SEXP times, SEXP lines, int n, int eof){
+  size_t start = 0;
+  while(n < Rf_length(lines) && start < stream->len){
+    char * nl = memchr(stream->buf + start, '\n', stream->len - start);
+    if(nl == NULL && !eof)
+      break;
+    size_t end = nl ? nl - stream->buf : stream->len;
+    size_t linelen = end - start;
+    if(linelen > 0 && stream->buf[start + linelen - 1] == '\r')
+      linelen--;
+    char * line = stream->buf + start;
+    for(char * nul = memchr(line, '\0', linelen); nul != NULL; nul = memchr(nul, '\0', line + linelen - nul))
+      *nul = '?';
+    cetype_t enc = valid_utf8((unsigned char *) line, linelen) ? CE_UTF8 : CE_BYTES;
+    SET_STRING_ELT(hosts, n, host);
+    SET_STRING_ELT(lines, n, Rf_mkCharLenCE(line, linelen, enc));
+    REAL(times)[n] = stream->received;
+    n++;
+    start = nl ? end + 1 : stream->len;
+  }
+  if(start > 0){
+    stream->len -= start;
+    memmove(stream->buf, stream->buf + start, stream->len);
+  }
+  return n;
+}
+
+static SEXP head_vector(SEXP x, int n){
+  SEXP out = PROTECT(Rf_allocVector(TYPEOF(x), n));
+  for(int i = 0; i < n; i++){
+    if(TYPEOF(x) == STRSXP){
+      SET_STRING_ELT(out, i, STRING_ELT(x, i));
+    } else {
+      REAL(out)[i] = REAL(x)[i];
+    }
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+/* Returns the error condition if the callback failed, or R_NilValue */
+static SEXP tail_deliver(SEXP fun, SEXP hosts, SEXP times, SEXP lines, int n, int *failed){
+  SEXP batch = PROTECT(Rf_allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(batch, 0, head_vector(hosts, n));
+  SET_VECTOR_ELT(batch, 1, head_vector(times, n));
+  SET_VECTOR_ELT(batch, 2, head_vector(lines, n));
+  SEXP call = PROTECT(Rf_lcons(fun, Rf_lcons(batch, R_NilValue)));
+  SEXP cond = try_callback(call, failed);
+  UNPROTECT(2);
+  return cond;
+}
+
+SEXP C_ssh_tail(SEXP sessions, SEXP labels, SEXP command, SEXP callback, SEXP interval, SEXP max_lines){
+  int nstreams = Rf_length(sessions);
+  double wait = Rf_asReal(interval);
+  tail_stream * streams = (tail_stream*) R_alloc(nstreams, sizeof(tail_stream));
+  memset(streams, 0, nstreams * sizeof(tail_stream));
+
+  /* check all sessions before opening any channel */
+  for(int i = 0; i < nstreams; i++)
+    ssh_ptr_get(VECTOR_ELT(sessions, i));
+  for(int i = 0; i < nstreams; i++){
+    ssh_session ssh = ssh_ptr_get(VECTOR_ELT(sessions, i));
+    ssh_channel channel = ssh_channel_new(ssh);
+    if(channel == NULL){
+      close_streams(streams, nstreams);
+      Rf_error("Error in ssh_channel_new(): %s\n", ssh_get_error(ssh));
+    }
+    if(ssh_channel_open_session(channel) != SSH_OK || ssh_channel_request_exec(channel, CHAR(STRING_ELT(command, 0))) != SSH_OK){
+      close_streams(streams, nstreams);
+      assert_channel(SSH_ERROR, "ssh_channel_request_exec", channel);
+    }
+    streams[i].channel = channel;
+  }
+
+  int n = 0;
+  int size = Rf_asInteger(max_lines);
+  SEXP hosts = PROTECT(Rf_allocVector(STRSXP, size));
+  SEXP times = PROTECT(Rf_allocVector(REALSXP, size));
+  SEXP lines = PROTECT(Rf_allocVector(STRSXP, size));
+  ssh_channel * readchans = (ssh_channel*) R_alloc(nstreams + 1, sizeof(ssh_channel));
+  double last = current_time();
+  while(!pending_interrupt()){
+    int nopen = 0;
+    int buffered = 0;
+    for(int i = 0; i < nstreams; i++){
+      if(ssh_channel_is_open(streams[i].channel) && !ssh_channel_is_eof(streams[i].channel))
+        readchans[nopen++] = streams[i].channel;
+    }
+    readchans[nopen] = NULL;
+    if(nopen > 0 && n < size){
+      struct timeval tv = {0, 100000}; //100ms
+      ssh_channel_select(readchans, NULL, NULL, &tv);
+    } else if(n == size) {
+      double remaining = wait - (current_time() - last);
+      if(remaining > 0)
+        usleep(remaining < 0.1 ? remaining * 1e6 : 100000);
+    }
+    for(int i = 0; i < nstreams; i++){
+      tail_stream * stream = &streams[i];
+      int eof = 0;
+      if(n < size){
+        if(tail_grow(stream) < 0){
+          close_streams(streams, nstreams);
+          Rf_error("Failed to allocate memory for ssh_tail() line buffer");
+        }
+        int nbytes = tail_read(stream);
+        eof = nbytes < 0 || (nbytes == 0 &&
+          (!ssh_channel_is_open(stream->channel) || ssh_channel_is_eof(stream->channel)));
+        buffered += nbytes > 0;
+      }
+      n = tail_lines(stream, STRING_ELT(labels, i), hosts, times, lines, n, eof);
+      buffered += stream->len;
+    }
+    if(n > 0 && (current_time() - last >= wait || (nopen == 0 && buffered == 0))){
+      int failed;
+      SEXP cond = PROTECT(tail_deliver(callback, hosts, times, lines, n, &failed));
+      if(failed){
+        close_streams(streams, nstreams);
+        raise_callback_error(cond, "ssh_tail() callback");
+      }
+      UNPROTECT(1);
+      last = current_time();
+      n = 0;
+    }
+    if(nopen == 0 && buffered == 0 && n == 0)
+      break;
+  }
+  close_streams(streams, nstreams);
+  UNPROTECT(3);
+  return R_NilValue;
+}
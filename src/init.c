@@ -7,33 +7,53 @@
 #include <libssh/callbacks.h>
 
 /* .Call calls */
+extern SEXP C_bandwidth_limit(SEXP, SEXP);
+extern SEXP C_bandwidth_stats(SEXP);
+extern SEXP C_blocking_socks_proxy(SEXP, SEXP, SEXP);
 extern SEXP C_blocking_tunnel(SEXP, SEXP, SEXP, SEXP);
 extern SEXP C_disconnect_session(SEXP);
+extern SEXP C_keystore_add(SEXP, SEXP);
+extern SEXP C_keystore_list(void);
+extern SEXP C_keystore_wipe(SEXP);
 extern SEXP C_libssh_version(void);
-extern SEXP C_scp_download_recursive(SEXP, SEXP, SEXP);
+extern SEXP C_scp_download_recursive(SEXP, SEXP, SEXP, SEXP);
 extern SEXP C_scp_read_file(SEXP, SEXP);
 extern SEXP C_scp_write_file(SEXP, SEXP, SEXP);
 extern SEXP C_scp_write_recursive(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_session_params(SEXP);
+extern SEXP C_session_timing(SEXP);
 extern SEXP C_ssh_exec(SEXP, SEXP, SEXP, SEXP);
 extern SEXP C_ssh_info(SEXP);
-extern SEXP C_start_session(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
-extern SEXP R_ssh_new_file_writer(SEXP);
+extern SEXP C_ssh_tail(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_start_session(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_ssh_new_file_writer(SEXP, SEXP, SEXP, SEXP);
 extern SEXP R_ssh_total_writers(void);
+extern SEXP R_ssh_wait_file_writer(SEXP);
 extern SEXP R_ssh_write_file_writer(SEXP, SEXP, SEXP);
 
 static const R_CallMethodDef CallEntries[] = {
+  {"C_bandwidth_limit",        (DL_FUNC) &C_bandwidth_limit,        2},
+  {"C_bandwidth_stats",        (DL_FUNC) &C_bandwidth_stats,        1},
+  {"C_blocking_socks_proxy",   (DL_FUNC) &C_blocking_socks_proxy,   3},
   {"C_blocking_tunnel",        (DL_FUNC) &C_blocking_tunnel,        4},
   {"C_disconnect_session",     (DL_FUNC) &C_disconnect_session,     1},
+  {"C_keystore_add",           (DL_FUNC) &C_keystore_add,           2},
+  {"C_keystore_list",          (DL_FUNC) &C_keystore_list,          0},
+  {"C_keystore_wipe",          (DL_FUNC) &C_keystore_wipe,          1},
   {"C_libssh_version",         (DL_FUNC) &C_libssh_version,         0},
-  {"C_scp_download_recursive", (DL_FUNC) &C_scp_download_recursive, 3},
+  {"C_scp_download_recursive", (DL_FUNC) &C_scp_download_recursive, 4},
   {"C_scp_read_file",          (DL_FUNC) &C_scp_read_file,          2},
   {"C_scp_write_file",         (DL_FUNC) &C_scp_write_file,         3},
   {"C_scp_write_recursive",    (DL_FUNC) &C_scp_write_recursive,    6},
+  {"C_session_params",         (DL_FUNC) &C_session_params,         1},
+  {"C_session_timing",         (DL_FUNC) &C_session_timing,         1},
   {"C_ssh_exec",               (DL_FUNC) &C_ssh_exec,               4},
   {"C_ssh_info",               (DL_FUNC) &C_ssh_info,               1},
-  {"C_start_session",          (DL_FUNC) &C_start_session,          6},
-  {"R_ssh_new_file_writer",    (DL_FUNC) &R_ssh_new_file_writer,    1},
+  {"C_ssh_tail",               (DL_FUNC) &C_ssh_tail,               6},
+  {"C_start_session",          (DL_FUNC) &C_start_session,          9},
+  {"R_ssh_new_file_writer",    (DL_FUNC) &R_ssh_new_file_writer,    4},
   {"R_ssh_total_writers",      (DL_FUNC) &R_ssh_total_writers,      0},
+  {"R_ssh_wait_file_writer",   (DL_FUNC) &R_ssh_wait_file_writer,   1},
   {"R_ssh_write_file_writer",  (DL_FUNC) &R_ssh_write_file_writer,  3},
   {NULL, NULL, 0}
 };
@@ -49,3 +69,7 @@ attribute_visible void R_init_ssh(DllInfo* dll) {
   ssh_set_log_callback(log_cb);
   //ssh_set_log_level(SSH_OPTIONS_LOG_VERBOSITY);
 }
+
+attribute_visible void R_unload_ssh(DllInfo* dll) {
+  C_keystore_wipe(R_NilValue);
+}
@@ -0,0 +1,141 @@
+/* Process-wide store for decrypted private keys. Each key is kept as an
+ * unencrypted base64 blob in its own locked pages, such that new sessions can
+ * import it without running the (slow) KDF or prompting for a passphrase. */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#include "myssh.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+typedef struct keystore_entry {
+  char * path;
+  char * b64;
+  size_t size;
+  struct keystore_entry * next;
+} keystore_entry;
+
+static keystore_entry * keystore = NULL;
+
+static void wipe_memory(void * ptr, size_t size){
+  volatile unsigned char * p = ptr;
+  while(size--)
+    *p++ = 0;
+}
+
+/* Locking is best effort: it may fail if RLIMIT_MEMLOCK is small */
+static char * secure_alloc(size_t size){
+#ifdef _WIN32
+  void * ptr = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if(ptr != NULL)
+    VirtualLock(ptr, size);
+#else
+  void * ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(ptr == MAP_FAILED)
+    return NULL;
+  mlock(ptr, size);
+#ifdef MADV_DONTDUMP
+  madvise(ptr, size, MADV_DONTDUMP);
+#endif
+#endif
+  return ptr;
+}
+
+static void secure_free(char * ptr, size_t size){
+  wipe_memory(ptr, size);
+#ifdef _WIN32
+  VirtualUnlock(ptr, size);
+  VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+  munlock(ptr, size);
+  munmap(ptr, size);
+#endif
+}
+
+static keystore_entry * keystore_find(const char * path){
+  for(keystore_entry * entry = keystore; entry != NULL; entry = entry->next){
+    if(!strcmp(entry->path, path))
+      return entry;
+  }
+  return NULL;
+}
+
+static void keystore_remove(const char * path){
+  keystore_entry ** ptr = &keystore;
+  while(*ptr != NULL){
+    keystore_entry * entry = *ptr;
+    if(path == NULL || !strcmp(entry->path, path)){
+      *ptr = entry->next;
+      secure_free(entry->b64, entry->size);
+      free(entry->path);
+      free(entry);
+    } else {
+      ptr = &entry->next;
+    }
+  }
+}
+
+/* Returns a new key object (to be freed by the caller) or NULL if not stored */
+ssh_key keystore_get(const char * path){
+  ssh_key key = NULL;
+  keystore_entry * entry = keystore_find(path);
+  if(entry && ssh_pki_import_privkey_base64(entry->b64, NULL, NULL, NULL, &key) != SSH_OK)
+    return NULL;
+  return key;
+}
+
+SEXP C_keystore_add(SEXP keyfile, SEXP rpass){
+  ssh_key key = NULL;
+  char * b64 = NULL;
+  const char * path = CHAR(STRING_ELT(keyfile, 0));
+  if(ssh_pki_import_privkey_file(path, NULL, my_auth_callback, rpass, &key) != SSH_OK)
+    Rf_error("Failed to read private key: %s", path);
+  int rc = ssh_pki_export_privkey_base64(key, NULL, NULL, NULL, &b64);
+  ssh_key_free(key);
+  if(rc != SSH_OK)
+    Rf_error("Failed to export private key: %s", path);
+  size_t len = strlen(b64);
+  keystore_entry * entry = calloc(1, sizeof(keystore_entry));
+  entry->size = len + 1;
+  entry->b64 = secure_alloc(entry->size);
+  if(entry->b64 != NULL)
+    memcpy(entry->b64, b64, entry->size);
+  wipe_memory(b64, len);
+  ssh_string_free_char(b64);
+  if(entry->b64 == NULL){
+    free(entry);
+    Rf_error("Failed to allocate memory for private key");
+  }
+  entry->path = strdup(path);
+  keystore_remove(path);
+  entry->next = keystore;
+  keystore = entry;
+  return keyfile;
+}
+
+SEXP C_keystore_list(void){
+  int n = 0;
+  for(keystore_entry * entry = keystore; entry != NULL; entry = entry->next)
+    n++;
+  SEXP out = PROTECT(Rf_allocVector(STRSXP, n));
+  n = 0;
+  for(keystore_entry * entry = keystore; entry != NULL; entry = entry->next)
+    SET_STRING_ELT(out, n++, Rf_mkCharCE(entry->path, CE_UTF8));
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP C_keystore_wipe(SEXP keyfile){
+  if(Rf_length(keyfile)){
+    for(int i = 0; i < Rf_length(keyfile); i++)
+      keystore_remove(CHAR(STRING_ELT(keyfile, i)));
+  } else {
+    keystore_remove(NULL);
+  }
+  return R_NilValue;
+}
@@ -18,7 +18,22 @@
 #define make_string(x) x ? Rf_mkString(x) : Rf_ScalarString(NA_STRING)
 ssh_session ssh_ptr_get(SEXP ptr);
 int pending_interrupt(void);
+double current_time(void);
 void assert_channel(int rc, const char * what, ssh_channel channel);
+SEXP try_callback(SEXP call, int *failed);
+void raise_callback_error(SEXP cond, const char * what);
+int my_auth_callback(const char *prompt, char *buf, size_t len, int echo, int verify, void *rpass);
+ssh_key keystore_get(const char * path);
+
+/* Buffered (background) file writer */
+struct file_writer;
+struct file_writer * writer_create(const char * path, size_t bufsize, double size, int async, int * err);
+int writer_write(struct file_writer * w, const void * data, size_t len);
+int writer_close(struct file_writer * w);
+
+/* Traffic classes for the bandwidth scheduler */
+enum bw_class {BW_BULK, BW_INTERACTIVE, BW_CLASSES};
+void bw_throttle(int cls, size_t bytes);
 
 /* Workaround from libcurl: https://github.com/curl/curl/pull/9383/files */
 #if defined(__GNUC__) && (LIBSSH_VERSION_MINOR >= 10) || (LIBSSH_VERSION_MAJOR > 0)
@@ -51,6 +51,8 @@ static SEXP stream_to_r(ssh_scp scp){
       return NULL;
     }
     read_bytes = ssh_scp_read(scp, ptr, size);
+    if(read_bytes != (size_t) SSH_ERROR)
+      bw_throttle(BW_BULK, read_bytes);
     ptr += read_bytes;
     size -= read_bytes;
     //REprintf("\r Remaining: %lld bytes", size);
@@ -89,57 +91,171 @@ SEXP C_scp_write_file(SEXP ptr, SEXP path, SEXP data){
   return path;
 }
 
-static void call_cb(SEXP data, SEXP cb, char * pwd[1000], int depth){
-  //REprintf("Running call_cb\n");
-  PROTECT(data);
+/* Calls cb(size, path, index) and stores its result, or its error condition, in results[slot].
+ * For files the callback returns the local target path; directories have size NA. */
+static int call_cb(double size, SEXP cb, char * pwd[1000], int depth, int index, SEXP results, int slot){
+  int failed;
+  SEXP rsize = PROTECT(Rf_ScalarReal(size));
   SEXP dir = PROTECT(dirvec_to_r(pwd, depth + 1));
-  SEXP call = PROTECT(Rf_lcons(cb, Rf_lcons(data, Rf_lcons(dir, R_NilValue))));
-  Rf_eval(call, R_GlobalEnv);
-  UNPROTECT(3);
+  SEXP rindex = PROTECT(Rf_ScalarInteger(index + 1));
+  SEXP call = PROTECT(Rf_lang4(cb, rsize, dir, rindex));
+  SET_VECTOR_ELT(results, slot, try_callback(call, &failed));
+  UNPROTECT(4);
+  return failed ? -1 : 0;
 }
 
-SEXP C_scp_download_recursive(SEXP ptr, SEXP path, SEXP cb){
-  ssh_session ssh = ssh_ptr_get(ptr);
-  ssh_scp scp = ssh_scp_new(ssh, SSH_SCP_READ | SSH_SCP_RECURSIVE, CHAR(STRING_ELT(path, 0)));
-  assert_scp(ssh_scp_init(scp), "ssh_scp_init", scp, ssh);
-  int status = SSH_OK;
-  int depth = 0;
+/* Each worker downloads one of the remote paths over its own scp channel, and
+ * streams every file straight to its own local writer */
+#define SCP_READ_CHUNK 1048576
+
+typedef struct {
+  ssh_scp scp;
+  int index;
+  int depth;
+  int infile;
+  int error;
   char * pwd[1000];
-  while(!pending_interrupt()){
-    switch((status = ssh_scp_pull_request(scp))){
-    case SSH_SCP_REQUEST_NEWFILE:
-      assert_scp(ssh_scp_accept_request(scp), "ssh_scp_accept_request", scp, ssh);
-      pwd[depth] = strdup(ssh_scp_request_get_filename(scp));
-      SEXP data = stream_to_r(scp);
-      if(data == NULL)
-        goto cleanup;
-      call_cb(data, cb, pwd, depth);
-      free(pwd[depth]);
-      break;
-    case SSH_SCP_REQUEST_NEWDIR:
-      ssh_scp_accept_request(scp);
-      pwd[depth++] = strdup(ssh_scp_request_get_filename(scp));
-      call_cb(R_NilValue, cb, pwd, depth - 1);
-      break;
-    case SSH_SCP_REQUEST_ENDDIR:
-      free(pwd[--depth]);
-      break;
-    case SSH_SCP_REQUEST_WARNING:
-      Rf_warningcall_immediate(R_NilValue, "SSH warning: %s\n",ssh_scp_request_get_warning(scp));
-      break;
-    case SSH_SCP_REQUEST_EOF:
-      goto cleanup;
-    case SSH_ERROR:
-      assert_scp(status, "ssh_scp_pull_request", scp, ssh);
-    default :
-      Rf_error("Error in ssh_scp_pull_request case: %d\n", status);
+  struct file_writer * writer;
+  uint64_t remaining;
+} scp_worker;
+
+static void close_worker(scp_worker *w){
+  if(w->writer != NULL)
+    writer_close(w->writer);
+  w->writer = NULL;
+  ssh_scp_close(w->scp);
+  ssh_scp_free(w->scp);
+  w->scp = NULL;
+  if(w->infile)
+    free(w->pwd[w->depth]);
+  while(w->depth > 0)
+    free(w->pwd[--w->depth]);
+  w->infile = 0;
+}
+
+static const char scp_callback_failed[] = "download callback";
+static const char scp_write_failed[] = "write file";
+static const char scp_no_target[] = "download target";
+
+static void fail_workers(scp_worker *workers, int n, int failed, const char * what, ssh_session ssh, SEXP results){
+  char buf[1024] = {0};
+  if(what == scp_write_failed){
+    snprintf(buf, 1023, "%s (%s)", CHAR(STRING_ELT(VECTOR_ELT(results, failed), 0)), strerror(workers[failed].error));
+  } else if(what == scp_no_target){
+    strncpy(buf, "callback did not return a file path", 1023);
+  } else {
+    strncpy(buf, ssh_get_error(ssh), 1023);
+  }
+  for(int i = 0; i < n; i++){
+    if(workers[i].scp != NULL)
+      close_worker(&workers[i]);
+  }
+  if(what == scp_callback_failed)
+    raise_callback_error(VECTOR_ELT(results, failed), "scp_download() callback");
+  Rf_errorcall(R_NilValue, "SCP failure at '%s': %s", what, buf);
+}
+
+/* Reads the next chunk or request; returns the failing call or NULL on success */
+static const char * worker_step(scp_worker *w, SEXP results, int slot, SEXP cb, void * buf){
+  if(w->infile){
+    if(w->remaining > 0){
+      int len = ssh_scp_read(w->scp, buf, w->remaining < SCP_READ_CHUNK ? w->remaining : SCP_READ_CHUNK);
+      if(len == SSH_ERROR)
+        return "ssh_scp_read";
+      bw_throttle(BW_BULK, len);
+      w->remaining -= len;
+      if((w->error = writer_write(w->writer, buf, len)))
+        return scp_write_failed;
+      if(w->remaining > 0)
+        return NULL;
+    } else if(ssh_scp_read(w->scp, buf, 0) == SSH_ERROR) {
+      /* empty file: libssh only acks the file and resets its state in ssh_scp_read() */
+      return "ssh_scp_read";
     }
+    w->error = writer_close(w->writer);
+    w->writer = NULL;
+    free(w->pwd[w->depth]);
+    w->infile = 0;
+    return w->error ? scp_write_failed : NULL;
   }
+  int status = ssh_scp_pull_request(w->scp);
+  switch(status){
+  case SSH_SCP_REQUEST_NEWFILE:
+    if(ssh_scp_accept_request(w->scp) != SSH_OK)
+      return "ssh_scp_accept_request";
+    w->remaining = ssh_scp_request_get_size64(w->scp);
+    w->pwd[w->depth] = strdup(ssh_scp_request_get_filename(w->scp));
+    w->infile = 1;
+    if(call_cb(w->remaining, cb, w->pwd, w->depth, w->index, results, slot))
+      return scp_callback_failed;
+    SEXP target = VECTOR_ELT(results, slot);
+    if(!Rf_isString(target) || Rf_length(target) != 1)
+      return scp_no_target;
+    /* files larger than one chunk are written from a background thread while reading the next chunk */
+    w->writer = writer_create(CHAR(STRING_ELT(target, 0)), 65536, w->remaining, w->remaining > SCP_READ_CHUNK, &w->error);
+    return w->writer ? NULL : scp_write_failed;
+  case SSH_SCP_REQUEST_NEWDIR:
+    ssh_scp_accept_request(w->scp);
+    w->pwd[w->depth++] = strdup(ssh_scp_request_get_filename(w->scp));
+    return call_cb(NA_REAL, cb, w->pwd, w->depth - 1, w->index, results, slot) ? scp_callback_failed : NULL;
+  case SSH_SCP_REQUEST_ENDDIR:
+    free(w->pwd[--w->depth]);
+    return NULL;
+  case SSH_SCP_REQUEST_WARNING:
+    Rf_warningcall_immediate(R_NilValue, "SSH warning: %s\n",ssh_scp_request_get_warning(w->scp));
+    return NULL;
+  case SSH_SCP_REQUEST_EOF:
+    close_worker(w);
+    return NULL;
+  }
+  return "ssh_scp_pull_request";
+}
 
-cleanup:
+/* Download all paths over up to 'workers' concurrent scp channels on the session.
+ * Workers are served round-robin, one chunk at a time, so that the remote ends
+ * keep streaming on all channels. */
+SEXP C_scp_download_recursive(SEXP ptr, SEXP paths, SEXP cb, SEXP rworkers){
+  ssh_session ssh = ssh_ptr_get(ptr);
+  int npaths = Rf_length(paths);
+  int nworkers = Rf_asInteger(rworkers);
+  nworkers = nworkers > npaths ? npaths : nworkers < 1 ? 1 : nworkers;
+  scp_worker *workers = (scp_worker*) R_alloc(nworkers, sizeof(scp_worker));
+  memset(workers, 0, nworkers * sizeof(scp_worker));
+  void * buf = R_alloc(SCP_READ_CHUNK, 1);
+  SEXP results = PROTECT(Rf_allocVector(VECSXP, nworkers));
+  int next = 0;
+  while(!pending_interrupt()){
+    int active = 0;
+    for(int i = 0; i < nworkers; i++){
+      scp_worker *w = &workers[i];
+      if(w->scp == NULL && next < npaths){
+        w->index = next++;
+        w->scp = ssh_scp_new(ssh, SSH_SCP_READ | SSH_SCP_RECURSIVE, CHAR(STRING_ELT(paths, w->index)));
+        if(w->scp == NULL)
+          fail_workers(workers, nworkers, i, "ssh_scp_new", ssh, results);
+        if(ssh_scp_init(w->scp) != SSH_OK)
+          fail_workers(workers, nworkers, i, "ssh_scp_init", ssh, results);
+      }
+      if(w->scp == NULL)
+        continue;
+      active++;
+      const char * what = worker_step(w, results, i, cb, buf);
+      if(what != NULL)
+        fail_workers(workers, nworkers, i, what, ssh, results);
+    }
+    if(active == 0)
+      break;
+  }
 
-  ssh_scp_close(scp);
-  ssh_scp_free(scp);
+  /* only when interrupted */
+  for(int i = 0; i < nworkers; i++){
+    if(workers[i].scp != NULL){
+      if(workers[i].infile)
+        ssh_scp_deny_request(workers[i].scp, "user interrupt");
+      close_worker(&workers[i]);
+    }
+  }
+  UNPROTECT(1);
   return R_NilValue;
 }
 
@@ -200,6 +316,7 @@ SEXP C_scp_write_recursive(SEXP ptr, SEXP sources, SEXP sizes, SEXP paths, SEXP
     do {
       assert_scp(ssh_scp_write(scp, buf, read), "ssh_scp_write", scp, ssh);
       read = fread(buf, sizeof(char), sizeof(buf), fp);
+      bw_throttle(BW_BULK, read);
       total = total + read;
       if(size && Rf_asLogical(verbose))
         Rprintf("\r[%d%%] %s", (int) round(100 * total/size), CHAR(STRING_ELT(sources, i)));
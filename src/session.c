@@ -1,38 +1,148 @@
+#include <sys/time.h>
+#include <unistd.h>
 #include "myssh.h"
 
+/* Keeps track of time spent in each phase of the connection setup */
+#define MAX_PHASES 16
+
+/* Allocated on the heap because libssh keeps the callbacks registered on the
+ * session for its lifetime; freed in ssh_ptr_fin() */
+typedef struct {
+  struct ssh_callbacks_struct callbacks;
+  SEXP rpass;
+  int done;
+  float status;
+  double last;
+  int nphases;
+  const char * phase[MAX_PHASES];
+  const char * method[MAX_PHASES];
+  double seconds[MAX_PHASES];
+  int success[MAX_PHASES];
+} session_setup;
+
+/* Order in which auth methods are tried by default */
+enum auth_method {AUTH_NONE, AUTH_PUBKEY, AUTH_AUTO, AUTH_INTERACTIVE, AUTH_PASSWORD, AUTH_COUNT};
+
+static const char * auth_names[AUTH_COUNT] = {"none", "publickey", "publickey-auto", "keyboard-interactive", "password"};
+
+static const int auth_masks[AUTH_COUNT] = {SSH_AUTH_METHOD_NONE, SSH_AUTH_METHOD_PUBLICKEY,
+  SSH_AUTH_METHOD_PUBLICKEY, SSH_AUTH_METHOD_INTERACTIVE, SSH_AUTH_METHOD_PASSWORD};
+
+double current_time(void){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void add_phase(session_setup *setup, const char * phase, const char * method, int success){
+  double now = current_time();
+  if(setup->nphases < MAX_PHASES){
+    setup->phase[setup->nphases] = phase;
+    setup->method[setup->nphases] = method;
+    setup->seconds[setup->nphases] = now - setup->last;
+    setup->success[setup->nphases] = success;
+    setup->nphases++;
+  }
+  setup->last = now;
+}
+
+static SEXP setup_to_r(session_setup *setup){
+  int n = setup->nphases;
+  SEXP phase = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP method = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP seconds = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP success = PROTECT(Rf_allocVector(LGLSXP, n));
+  for(int i = 0; i < n; i++){
+    SET_STRING_ELT(phase, i, Rf_mkChar(setup->phase[i]));
+    SET_STRING_ELT(method, i, setup->method[i] ? Rf_mkChar(setup->method[i]) : NA_STRING);
+    REAL(seconds)[i] = setup->seconds[i];
+    LOGICAL(success)[i] = setup->success[i];
+  }
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(out, 0, phase);
+  SET_VECTOR_ELT(out, 1, method);
+  SET_VECTOR_ELT(out, 2, seconds);
+  SET_VECTOR_ELT(out, 3, success);
+  UNPROTECT(5);
+  return out;
+}
+
+/* libssh reports 0.2 after resolving the host, 0.4 once banners have been
+ * exchanged and 1.0 when the key exchange has completed. It also calls this
+ * again during every rekey, which is ignored once setup is done. */
+static void connect_status_cb(void *userdata, float status){
+  session_setup *setup = userdata;
+  if(setup->done)
+    return;
+  if(status >= 0.2f && setup->status < 0.2f)
+    add_phase(setup, "dns", NULL, TRUE);
+  if(status >= 0.4f && setup->status < 0.4f)
+    add_phase(setup, "connect", NULL, TRUE);
+  if(status >= 1.0f && setup->status < 1.0f)
+    add_phase(setup, "kex", NULL, TRUE);
+  if(status > setup->status)
+    setup->status = status;
+}
+
+/* After a fork() the child shares the socket and crypto state with the parent */
+static int is_forked(SEXP ptr){
+  return Rf_asInteger(R_ExternalPtrTag(ptr)) != getpid();
+}
+
 ssh_session ssh_ptr_get(SEXP ptr){
   ssh_session ssh = (ssh_session) R_ExternalPtrAddr(ptr);
   if(ssh == NULL)
     Rf_error("SSH session pointer is dead");
+  if(is_forked(ptr))
+    Rf_error("SSH session was created in another (parent) process. Use ssh_session_clone() to open a new connection in this process");
   //if(!ssh_is_connected(ssh))
   //  Rf_error("ssh session has been disconnected");
   return ssh;
 }
 
+/* The protected slot holds list(timing, params, setup) */
+#define PTR_TIMING 0
+#define PTR_PARAMS 1
+#define PTR_SETUP 2
+
 static void ssh_ptr_fin(SEXP ptr){
   ssh_session ssh = (ssh_session) R_ExternalPtrAddr(ptr);
   if(ssh == NULL)
     return;
+  /* never disconnect the session of the parent process */
+  if(is_forked(ptr)){
+    R_ClearExternalPtr(ptr);
+    return;
+  }
   if(ssh_is_connected(ssh)){
     Rf_warningcall(R_NilValue, "Disconnecting from unused ssh session. Please use ssh_disconnect()\n");
     ssh_disconnect(ssh);
   }
   ssh_free(ssh);
   R_ClearExternalPtr(ptr);
+  SEXP setup = VECTOR_ELT(R_ExternalPtrProtected(ptr), PTR_SETUP);
+  free(R_ExternalPtrAddr(setup));
+  R_ClearExternalPtr(setup);
 }
 
-static SEXP ssh_ptr_create(ssh_session ssh){
-  SEXP ptr = PROTECT(R_MakeExternalPtr(ssh, R_NilValue, R_NilValue));
+static SEXP ssh_ptr_create(ssh_session ssh, session_setup *setup){
+  SEXP pid = PROTECT(Rf_ScalarInteger(getpid()));
+  SEXP prot = PROTECT(Rf_allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(prot, PTR_SETUP, R_MakeExternalPtr(setup, R_NilValue, R_NilValue));
+  SEXP ptr = PROTECT(R_MakeExternalPtr(ssh, pid, prot));
   R_RegisterCFinalizerEx(ptr, ssh_ptr_fin, TRUE);
   Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("ssh_session"));
-  UNPROTECT(1);
+  UNPROTECT(3);
   return ptr;
 }
 
-static void assert_or_disconnect(int rc, const char * what, ssh_session ssh){
+/* Also frees the (decrypted) private key, if any, before raising the error */
+static void assert_or_disconnect(int rc, const char * what, ssh_session ssh, ssh_key privkey){
   if (rc != SSH_OK){
     char buf[1024];
     strncpy(buf, ssh_get_error(ssh), 1023);
+    if(privkey != NULL)
+      ssh_key_free(privkey);
     ssh_disconnect(ssh);
     Rf_errorcall(R_NilValue, "libssh failure at '%s': %s", what, buf);
   }
@@ -63,10 +173,15 @@ static int password_cb(SEXP rpass, const char * prompt, char *buf, int buflen, c
   return SSH_ERROR;
 }
 
-static int my_auth_callback(const char *prompt, char *buf, size_t len, int echo, int verify, void *rpass){
+int my_auth_callback(const char *prompt, char *buf, size_t len, int echo, int verify, void *rpass){
   return password_cb((SEXP) rpass, prompt, buf, len, "");
 }
 
+static int session_auth_callback(const char *prompt, char *buf, size_t len, int echo, int verify, void *userdata){
+  session_setup *setup = userdata;
+  return password_cb(setup->rpass, prompt, buf, len, "");
+}
+
 static int auth_password(ssh_session ssh, SEXP rpass, const char *user){
   char buf[1024];
   char prompt[1024];
@@ -98,34 +213,81 @@ static int auth_interactive(ssh_session ssh, SEXP rpass, const char *user){
   return rc;
 }
 
-/* authenticate client */
-static void auth_or_disconnect(ssh_session ssh, ssh_key privkey, SEXP rpass, const char *user){
-  if(ssh_userauth_none(ssh, NULL) == SSH_AUTH_SUCCESS)
-    return;
-  int method = ssh_userauth_list(ssh, NULL);
-  if (method & SSH_AUTH_METHOD_PUBLICKEY){
-    if(privkey != NULL && ssh_userauth_publickey(ssh, NULL, privkey) == SSH_AUTH_SUCCESS)
-      return;
+static int try_auth(ssh_session ssh, int method, ssh_key privkey, SEXP rpass, const char *user){
+  switch(method){
+  case AUTH_NONE:
+    return ssh_userauth_none(ssh, NULL);
+  case AUTH_PUBKEY:
+    return ssh_userauth_publickey(ssh, NULL, privkey);
+  case AUTH_AUTO:
     // ssh_userauth_publickey_auto() tries both ssh-agent and standard keys in ~/.ssh
     // it also automatically picks up SSH_ASKPASS env var set by 'askpass' package
-    if(privkey == NULL && ssh_userauth_publickey_auto(ssh, NULL, NULL) == SSH_AUTH_SUCCESS)
-      return;
+    return ssh_userauth_publickey_auto(ssh, NULL, NULL);
+  case AUTH_INTERACTIVE:
+    return auth_interactive(ssh, rpass, user);
+  case AUTH_PASSWORD:
+    return auth_password(ssh, rpass, user);
   }
-  if (method & SSH_AUTH_METHOD_INTERACTIVE && auth_interactive(ssh, rpass, user) == SSH_AUTH_SUCCESS)
+  return SSH_AUTH_ERROR;
+}
+
+/* Returns TRUE on success */
+static int attempt_auth(ssh_session ssh, int method, ssh_key privkey, SEXP rpass, const char *user, session_setup *setup){
+  /* explicit key replaces the default keys */
+  if((method == AUTH_PUBKEY && privkey == NULL) || (method == AUTH_AUTO && privkey != NULL))
+    return FALSE;
+  int success = try_auth(ssh, method, privkey, rpass, user) == SSH_AUTH_SUCCESS;
+  add_phase(setup, "auth", auth_names[method], success);
+  return success;
+}
+
+/* authenticate client, starting with the method that worked last time (if any) */
+static void auth_or_disconnect(ssh_session ssh, ssh_key privkey, SEXP rpass, const char *user, int prefer, session_setup *setup){
+  if(prefer > AUTH_NONE && attempt_auth(ssh, prefer, privkey, rpass, user, setup))
     return;
-  if (method & SSH_AUTH_METHOD_PASSWORD && auth_password(ssh, rpass, user) == SSH_AUTH_SUCCESS)
+  if(attempt_auth(ssh, AUTH_NONE, privkey, rpass, user, setup))
     return;
+  int methods = ssh_userauth_list(ssh, NULL);
+  for(int method = AUTH_NONE + 1; method < AUTH_COUNT; method++){
+    if(method != prefer && (methods & auth_masks[method]) && attempt_auth(ssh, method, privkey, rpass, user, setup))
+      return;
+  }
+  if(privkey != NULL)
+    ssh_key_free(privkey);
   ssh_disconnect(ssh);
   Rf_errorcall(R_NilValue, "Authentication with ssh server failed");
 }
 
-SEXP C_start_session(SEXP rhost, SEXP rport, SEXP ruser, SEXP keyfile, SEXP rpass, SEXP verbosity){
+SEXP C_start_session(SEXP rhost, SEXP rport, SEXP ruser, SEXP keyfile, SEXP rpass, SEXP verbosity, SEXP rjump, SEXP rprefer, SEXP rparams){
+#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0,11,0)
+  if(Rf_length(rjump))
+    Rf_error("Connecting via jump hosts requires libssh 0.11 or newer");
+#endif
+
+  session_setup *setup = calloc(1, sizeof(session_setup));
+  if(setup == NULL)
+    Rf_error("Failed to allocate session");
+  setup->rpass = rpass;
+  setup->last = current_time();
 
-  /* try reading private key first */
+  /* try reading private key first (from the keystore if it was decrypted before) */
   ssh_key privkey = NULL;
-  if(Rf_length(keyfile))
-    if(ssh_pki_import_privkey_file(CHAR(STRING_ELT(keyfile, 0)), NULL, my_auth_callback, rpass, &privkey) != SSH_OK)
-      Rf_error("Failed to read private key: %s", CHAR(STRING_ELT(keyfile, 0)));
+  if(Rf_length(keyfile)){
+    const char * path = CHAR(STRING_ELT(keyfile, 0));
+    privkey = keystore_get(path);
+    if(privkey == NULL && ssh_pki_import_privkey_file(path, NULL, my_auth_callback, rpass, &privkey) != SSH_OK){
+      free(setup);
+      Rf_error("Failed to read private key: %s", path);
+    }
+    add_phase(setup, "keyfile", NULL, TRUE);
+  }
+
+  /* auth method that succeeded on a previous connection */
+  int prefer = -1;
+  for(int i = 0; i < AUTH_COUNT; i++){
+    if(Rf_length(rprefer) && !strcmp(CHAR(STRING_ELT(rprefer, 0)), auth_names[i]))
+      prefer = i;
+  }
 
   /* load options */
   int loglevel = Rf_asInteger(verbosity);
@@ -133,29 +295,37 @@ SEXP C_start_session(SEXP rhost, SEXP rport, SEXP ruser, SEXP keyfile, SEXP rpas
   const char * host = CHAR(STRING_ELT(rhost, 0));
   const char * user = CHAR(STRING_ELT(ruser, 0));
   ssh_session ssh = ssh_new();
-  SEXP ptr = PROTECT(ssh_ptr_create(ssh));
-  assert_or_disconnect(ssh_options_set(ssh, SSH_OPTIONS_HOST, host), "set host", ssh);
-  assert_or_disconnect(ssh_options_set(ssh, SSH_OPTIONS_USER, user), "set user", ssh);
-  assert_or_disconnect(ssh_options_set(ssh, SSH_OPTIONS_PORT, &port), "set port", ssh);
-  assert_or_disconnect(ssh_options_set(ssh, SSH_OPTIONS_LOG_VERBOSITY, &loglevel), "set verbosity", ssh);
-
-  /* sets password callback for default private key */
-  struct ssh_callbacks_struct cb = {
-    .userdata = rpass,
-    .auth_function = my_auth_callback
-  };
-  ssh_callbacks_init(&cb);
-  ssh_set_callbacks(ssh, &cb);
+  SEXP ptr = PROTECT(ssh_ptr_create(ssh, setup));
+  assert_or_disconnect(ssh_options_set(ssh, SSH_OPTIONS_HOST, host), "set host", ssh, privkey);
+  assert_or_disconnect(ssh_options_set(ssh, SSH_OPTIONS_USER, user), "set user", ssh, privkey);
+  assert_or_disconnect(ssh_options_set(ssh, SSH_OPTIONS_PORT, &port), "set port", ssh, privkey);
+  assert_or_disconnect(ssh_options_set(ssh, SSH_OPTIONS_LOG_VERBOSITY, &loglevel), "set verbosity", ssh, privkey);
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,11,0)
+  /* inner session is carried over a direct-tcpip channel of the jump session(s) */
+  if(Rf_length(rjump))
+    assert_or_disconnect(ssh_options_set(ssh, SSH_OPTIONS_PROXYJUMP, CHAR(STRING_ELT(rjump, 0))), "set proxyjump", ssh, privkey);
+#endif
+
+  /* sets password callback for default private key and tracks connection progress */
+  setup->callbacks.userdata = setup;
+  setup->callbacks.auth_function = session_auth_callback;
+  setup->callbacks.connect_status_function = connect_status_cb;
+  ssh_callbacks_init(&setup->callbacks);
+  ssh_set_callbacks(ssh, &setup->callbacks);
 
   /* connect */
-  assert_or_disconnect(ssh_connect(ssh), "connect", ssh);
+  setup->last = current_time();
+  assert_or_disconnect(ssh_connect(ssh), "connect", ssh, privkey);
+  if(setup->status < 1.0f)
+    add_phase(setup, setup->status < 0.4f ? "connect" : "kex", NULL, TRUE);
+  setup->done = 1;
 
   /* get server identity */
   ssh_key key;
   unsigned char * hash = NULL;
   size_t hlen = 0;
-  assert_or_disconnect(myssh_get_publickey(ssh, &key), "myssh_get_publickey", ssh);
-  assert_or_disconnect(ssh_get_publickey_hash(key, SSH_PUBLICKEY_HASH_SHA1, &hash, &hlen), "ssh_get_publickey_hash", ssh);
+  assert_or_disconnect(myssh_get_publickey(ssh, &key), "myssh_get_publickey", ssh, privkey);
+  assert_or_disconnect(ssh_get_publickey_hash(key, SSH_PUBLICKEY_HASH_SHA1, &hash, &hlen), "ssh_get_publickey_hash", ssh, privkey);
 #if LIBSSH_VERSION_MINOR < 8
   if(!ssh_is_server_known(ssh)){
     Rprintf("Server fingerprint: %s\n", ssh_get_hexa(hash, hlen));
@@ -181,9 +351,17 @@ SEXP C_start_session(SEXP rhost, SEXP rport, SEXP ruser, SEXP keyfile, SEXP rpas
     break;
   }
 #endif
+  add_phase(setup, "hostkey", NULL, TRUE);
 
   /* Authenticate client or error */
-  auth_or_disconnect(ssh, privkey, rpass, user);
+  auth_or_disconnect(ssh, privkey, rpass, user, prefer, setup);
+  if(privkey != NULL)
+    ssh_key_free(privkey);
+  /* timing and the parameters for ssh_session_clone() are kept out of sight in the pointer */
+  SEXP prot = R_ExternalPtrProtected(ptr);
+  SET_VECTOR_ELT(prot, PTR_TIMING, setup_to_r(setup));
+  SET_VECTOR_ELT(prot, PTR_PARAMS, rparams);
+  setup->rpass = R_NilValue;
 
   /* display welcome message */
   char * banner = ssh_get_issue_banner(ssh);
@@ -213,8 +391,8 @@ SEXP C_ssh_info(SEXP ptr){
   unsigned char * hash = NULL;
   size_t hlen = 0;
   if (connected) {
-    assert_or_disconnect(myssh_get_publickey(ssh, &key), "ssh_get_publickey", ssh);
-    assert_or_disconnect(ssh_get_publickey_hash(key, SSH_PUBLICKEY_HASH_SHA1, &hash, &hlen), "ssh_get_publickey_hash", ssh);
+    assert_or_disconnect(myssh_get_publickey(ssh, &key), "ssh_get_publickey", ssh, NULL);
+    assert_or_disconnect(ssh_get_publickey_hash(key, SSH_PUBLICKEY_HASH_SHA1, &hash, &hlen), "ssh_get_publickey_hash", ssh, NULL);
   }
 
   SEXP out = PROTECT(Rf_allocVector(VECSXP, 6));
@@ -231,6 +409,19 @@ SEXP C_ssh_info(SEXP ptr){
   return out;
 }
 
+SEXP C_session_timing(SEXP ptr){
+  ssh_ptr_get(ptr);
+  return VECTOR_ELT(R_ExternalPtrProtected(ptr), PTR_TIMING);
+}
+
+/* Also works in a forked process, where the session itself can not be used */
+SEXP C_session_params(SEXP ptr){
+  SEXP prot = R_ExternalPtrProtected(ptr);
+  if(R_ExternalPtrAddr(ptr) == NULL || Rf_length(prot) <= PTR_PARAMS)
+    Rf_error("SSH session pointer is dead");
+  return VECTOR_ELT(prot, PTR_PARAMS);
+}
+
 SEXP C_disconnect_session(SEXP ptr){
   ssh_disconnect(ssh_ptr_get(ptr));
   return R_NilValue;
@@ -61,6 +61,10 @@ static void set_blocking(int sockfd){
 #define getsyserror() strerror(errno)
 #endif
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 /* Check for interrupt without long jumping */
 static void check_interrupt_fn(void *dummy) {
   R_ProcessEvents();
@@ -123,13 +127,13 @@ static int wait_for_fd(int fd, int port){
   return active;
 }
 
-static int open_port(int port){
+static int open_port(int port, int backlog, int loopback){
 
   // define server socket
   struct sockaddr_in serv_addr;
   memset(&serv_addr, '0', sizeof(serv_addr));
   serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  serv_addr.sin_addr.s_addr = htonl(loopback ? INADDR_LOOPBACK : INADDR_ANY);
   serv_addr.sin_port = htons(port);
 
   //creates the listening socket
@@ -144,7 +148,7 @@ static int open_port(int port){
 #endif
 
   syserror_if(bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0, "bind()");
-  syserror_if(listen(listenfd, 0) < 0, "listen()");
+  syserror_if(listen(listenfd, backlog) < 0, "listen()");
   return listenfd;
 }
 
@@ -165,6 +169,7 @@ static void host_tunnel(ssh_channel tunnel, int connfd){
 
     /* Pipe local socket data to ssh channel */
     while((avail = recv(connfd, buf, sizeof(buf), 0)) > 0){
+      bw_throttle(BW_INTERACTIVE, avail);
       ssh_channel_write(tunnel, buf, avail);
       print_progress(avail);
     }
@@ -174,6 +179,7 @@ static void host_tunnel(ssh_channel tunnel, int connfd){
 
     /* Pipe ssh stdout data to local socket */
     while((avail = ssh_channel_read_nonblocking(tunnel, buf, sizeof(buf), 0)) > 0){
+      bw_throttle(BW_INTERACTIVE, avail);
       syserror_if(send(connfd, buf, avail, 0) < avail, "send() to user");
       print_progress(avail);
     }
@@ -194,7 +200,7 @@ static void host_tunnel(ssh_channel tunnel, int connfd){
 }
 
 static void open_tunnel(ssh_session ssh, int port, const char * outhost, int outport){
-  int listenfd = open_port(port);
+  int listenfd = open_port(port, 0, 0);
   if(wait_for_fd(listenfd, port) == 0)
     goto cleanup;
   int connfd = accept(listenfd, NULL, NULL);
@@ -215,6 +221,254 @@ cleanup:
 #endif
 }
 
+/* SOCKS5 proxy (RFC 1928): each CONNECT request gets its own direct-tcpip
+ * channel, all multiplexed over the same authenticated ssh session. */
+#define SOCKS_MAX_CLIENTS 64
+
+enum socks_state {SOCKS_GREETING, SOCKS_REQUEST, SOCKS_CONNECTED};
+
+typedef struct {
+  int fd;
+  enum socks_state state;
+  ssh_channel channel;
+  int client_eof;
+  unsigned char buf[512];
+  size_t len;
+} socks_client;
+
+static void close_socket(int fd){
+#ifdef _WIN32
+  closesocket(fd);
+#else
+  close(fd);
+#endif
+}
+
+/* Send everything, also when the (non-blocking) socket is temporarily full */
+static int send_all(int fd, const char * buf, int len){
+  while(len > 0){
+    int n = send(fd, buf, len, MSG_NOSIGNAL);
+    if(n < 0){
+      if(!NONBLOCK_OK || pending_interrupt())
+        return -1;
+      fd_set wfds;
+      FD_ZERO(&wfds);
+      FD_SET(fd, &wfds);
+      struct timeval tv = {0, 100000};
+      select(fd + 1, NULL, &wfds, NULL, &tv);
+      continue;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int socks_reply(socks_client *client, unsigned char rep){
+  char reply[10] = {5, rep, 0, 1, 0, 0, 0, 0, 0, 0};
+  return send_all(client->fd, reply, sizeof(reply));
+}
+
+static void socks_close(socks_client *client){
+  if(client->channel){
+    if(!client->client_eof)
+      ssh_channel_send_eof(client->channel);
+    ssh_channel_close(client->channel);
+    ssh_channel_free(client->channel);
+  }
+  set_blocking(client->fd);
+  shutdown(client->fd, SHUTDOWN_SIGNAL);
+  close_socket(client->fd);
+}
+
+/* Returns the size of the request, 0 if incomplete or -1 for unsupported address types */
+static int socks_parse_request(socks_client *client, char * host, size_t hostlen, int * port){
+  unsigned char *b = client->buf;
+  if(client->len < 5)
+    return 0;
+  size_t addrlen;
+  switch(b[3]){
+  case 1: addrlen = 4; break;
+  case 3: addrlen = 1 + b[4]; break;
+  case 4: addrlen = 16; break;
+  default: return -1;
+  }
+  size_t size = 4 + addrlen + 2;
+  if(client->len < size)
+    return 0;
+  switch(b[3]){
+  case 1:
+    snprintf(host, hostlen, "%d.%d.%d.%d", b[4], b[5], b[6], b[7]);
+    break;
+  case 3:
+    memcpy(host, b + 5, b[4]);
+    host[b[4]] = '\0';
+    break;
+  case 4:
+    snprintf(host, hostlen, "%x:%x:%x:%x:%x:%x:%x:%x",
+             b[4] << 8 | b[5], b[6] << 8 | b[7], b[8] << 8 | b[9], b[10] << 8 | b[11],
+             b[12] << 8 | b[13], b[14] << 8 | b[15], b[16] << 8 | b[17], b[18] << 8 | b[19]);
+    break;
+  }
+  *port = b[size - 2] << 8 | b[size - 1];
+  return size;
+}
+
+/* Advance the SOCKS negotiation. Returns -1 if the client should be dropped. */
+static int socks_handshake(ssh_session ssh, socks_client *client, int port){
+  int avail = recv(client->fd, (char*) client->buf + client->len, sizeof(client->buf) - client->len, 0);
+  if(avail == 0 || (avail < 0 && !NONBLOCK_OK))
+    return -1;
+  if(avail > 0)
+    client->len += avail;
+
+  if(client->state == SOCKS_GREETING){
+    if(client->len < 2 || client->len < 2 + (size_t) client->buf[1])
+      return 0;
+    if(client->buf[0] != 5)
+      return -1;
+    size_t size = 2 + client->buf[1];
+    char method = (char) 0xFF;
+    for(size_t i = 2; i < size; i++){
+      if(client->buf[i] == 0)
+        method = 0; //we only support 'no authentication'
+    }
+    char reply[2] = {5, method};
+    if(send_all(client->fd, reply, 2) < 0 || method)
+      return -1;
+    client->len -= size;
+    memmove(client->buf, client->buf + size, client->len);
+    client->state = SOCKS_REQUEST;
+  }
+
+  if(client->state == SOCKS_REQUEST){
+    char host[256];
+    int outport = 0;
+    int size = socks_parse_request(client, host, sizeof(host), &outport);
+    if(size < 0){
+      socks_reply(client, 8);
+      return -1;
+    }
+    if(size == 0)
+      return 0;
+    if(client->buf[0] != 5 || client->buf[1] != 1){
+      socks_reply(client, 7); //only CONNECT is supported
+      return -1;
+    }
+    client->channel = ssh_channel_new(ssh);
+    if(client->channel == NULL){
+      socks_reply(client, 1);
+      return -1;
+    }
+    if(ssh_channel_open_forward(client->channel, host, outport, "localhost", port) != SSH_OK){
+      REprintf("\nFailed to open channel to %s:%d: %s\n", host, outport, ssh_get_error(ssh));
+      ssh_channel_free(client->channel);
+      client->channel = NULL;
+      socks_reply(client, 5);
+      return -1;
+    }
+    if(socks_reply(client, 0) < 0)
+      return -1;
+    client->state = SOCKS_CONNECTED;
+
+    /* Client may already have sent data after the request */
+    client->len -= size;
+    if(client->len > 0)
+      ssh_channel_write(client->channel, client->buf + size, client->len);
+    client->len = 0;
+  }
+  return 0;
+}
+
+/* Pipe data both ways. When the client half-closes, the eof is forwarded and the
+ * response is still delivered. Returns -1 once the channel is done. */
+static int socks_pump(socks_client *client, char * buf, int bufsize){
+  int avail = 0;
+  while(!client->client_eof && (avail = recv(client->fd, buf, bufsize, 0)) > 0){
+    bw_throttle(BW_INTERACTIVE, avail);
+    if(ssh_channel_write(client->channel, buf, avail) == SSH_ERROR)
+      return -1;
+  }
+  if(!client->client_eof && avail == 0){
+    client->client_eof = 1;
+    if(ssh_channel_send_eof(client->channel) == SSH_ERROR)
+      return -1;
+  } else if(!client->client_eof && avail < 0 && !NONBLOCK_OK){
+    return -1;
+  }
+  while((avail = ssh_channel_read_nonblocking(client->channel, buf, bufsize, 0)) > 0){
+    bw_throttle(BW_INTERACTIVE, avail);
+    if(send_all(client->fd, buf, avail) < 0)
+      return -1;
+  }
+  if(avail == SSH_ERROR || !ssh_channel_is_open(client->channel) || ssh_channel_is_eof(client->channel))
+    return -1;
+  return 0;
+}
+
+static void socks_proxy(ssh_session ssh, int port, int public){
+  static socks_client clients[SOCKS_MAX_CLIENTS];
+  static char buf[16384];
+  int nclients = 0;
+  int listenfd = open_port(port, SOCKS_MAX_CLIENTS, !public);
+  set_nonblocking(listenfd);
+  Rprintf("SOCKS5 proxy listening on %s:%d\n", public ? "0.0.0.0" : "127.0.0.1", port);
+  while(!pending_interrupt()){
+    fd_set rfds;
+    int maxfd = listenfd;
+    int nchannels = 0;
+    ssh_channel channels[SOCKS_MAX_CLIENTS + 1];
+    ssh_channel out[SOCKS_MAX_CLIENTS + 1];
+    struct timeval tv = {0, 100000}; //100ms
+    FD_ZERO(&rfds);
+    FD_SET(listenfd, &rfds);
+    for(int i = 0; i < nclients; i++){
+      if(!clients[i].client_eof){ //half-closed socket would always be readable
+        FD_SET(clients[i].fd, &rfds);
+        maxfd = clients[i].fd > maxfd ? clients[i].fd : maxfd;
+      }
+      if(clients[i].channel)
+        channels[nchannels++] = clients[i].channel;
+    }
+    channels[nchannels] = NULL;
+    if(nchannels > 0){
+      ssh_select(channels, out, maxfd + 1, &rfds, &tv);
+    } else {
+      select(maxfd + 1, &rfds, NULL, NULL, &tv);
+    }
+
+    /* Accept new clients */
+    int connfd;
+    while(nclients < SOCKS_MAX_CLIENTS && (connfd = accept(listenfd, NULL, NULL)) >= 0){
+      set_nonblocking(connfd);
+      memset(&clients[nclients], 0, sizeof(socks_client));
+      clients[nclients++].fd = connfd;
+    }
+
+    /* Serve existing clients, drop the ones that are done */
+    for(int i = 0; i < nclients; i++){
+      socks_client *client = &clients[i];
+      int rc = client->state == SOCKS_CONNECTED ?
+        socks_pump(client, buf, sizeof(buf)) : socks_handshake(ssh, client, port);
+      if(rc < 0){
+        socks_close(client);
+        clients[i--] = clients[--nclients];
+      }
+    }
+    Rprintf("\r%c Proxying %d connections... ", spinner(), nclients);
+  }
+  while(nclients > 0)
+    socks_close(&clients[--nclients]);
+  close_socket(listenfd);
+  Rprintf("\nproxy closed!\n");
+}
+
+/* Run a SOCKS5 proxy until interrupted */
+SEXP C_blocking_socks_proxy(SEXP ptr, SEXP port, SEXP public){
+  socks_proxy(ssh_ptr_get(ptr), Rf_asInteger(port), Rf_asLogical(public));
+  return R_NilValue;
+}
+
 /* Set up tunnel to the target host */
 SEXP C_blocking_tunnel(SEXP ptr, SEXP port, SEXP target_host, SEXP target_port){
   open_tunnel(ssh_ptr_get(ptr), Rf_asInteger(port), CHAR(STRING_ELT(target_host, 0)), Rf_asInteger(target_port));
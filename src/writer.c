@@ -1,39 +1,262 @@
 #include <Rinternals.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 
-/* Copied from the 'curl' package to support large files */
+/* Copied from the 'curl' package to support large files.
+ * Data goes through a large stdio buffer (no flush per chunk) and can optionally
+ * be written from a background thread, such that disk writes overlap with reading
+ * from the network. If the final size is known, the file gets preallocated.
+ * Besides the R interface, scp_download() uses writer_create() and friends to
+ * stream each file to disk chunk by chunk. */
+
+#define MAX_PENDING_BYTES 16777216 //16MB
+
+typedef struct chunk {
+  struct chunk *next;
+  size_t len;
+  unsigned char data[];
+} chunk;
+
+typedef struct file_writer {
+  FILE *fp;
+  char *buffer;
+  size_t bufsize;
+  double size;
+  double written;
+  int async;
+  int running;
+  int closing;
+  int error;
+  size_t pending;
+  chunk *head;
+  chunk *tail;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} file_writer;
 
 static int total_open_writers = 0;
 
+static int write_chunk(file_writer *w, const void *data, size_t len){
+  size_t n = fwrite(data, 1, len, w->fp);
+  w->written += n;
+  return n < len ? (errno ? errno : EIO) : 0;
+}
+
+static void close_file(file_writer *w){
+  if(fflush(w->fp) != 0 && !w->error)
+    w->error = errno ? errno : EIO;
+#ifdef __linux__
+  /* remove preallocated space that was not used */
+  if(w->size > w->written && ftruncate(fileno(w->fp), (off_t) w->written) != 0 && !w->error)
+    w->error = errno;
+#endif
+  fclose(w->fp);
+  w->fp = NULL;
+}
+
+static void *writer_thread(void *arg){
+  file_writer *w = arg;
+  pthread_mutex_lock(&w->lock);
+  while(1){
+    while(w->head == NULL && !w->closing)
+      pthread_cond_wait(&w->cond, &w->lock);
+    chunk *next = w->head;
+    if(next == NULL)
+      break;
+    w->head = next->next;
+    if(w->head == NULL)
+      w->tail = NULL;
+    pthread_mutex_unlock(&w->lock);
+    int err = w->error ? 0 : write_chunk(w, next->data, next->len);
+    pthread_mutex_lock(&w->lock);
+    if(err)
+      w->error = err;
+    w->pending -= next->len;
+    free(next);
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  close_file(w);
+  return NULL;
+}
+
+/* Returns 0 or the errno from opening the file */
+static int writer_open(file_writer *w, const char *path){
+  w->fp = fopen(path, "wb");
+  if(!w->fp)
+    return errno ? errno : EIO;
+  if(w->bufsize > 0 && w->buffer == NULL)
+    w->buffer = malloc(w->bufsize);
+  setvbuf(w->fp, w->buffer, w->buffer ? _IOFBF : _IONBF, w->bufsize);
+#ifdef __linux__
+  if(w->size > 0)
+    posix_fallocate(fileno(w->fp), 0, (off_t) w->size);
+#endif
+  w->written = 0;
+  w->error = 0;
+  w->closing = 0;
+  total_open_writers++;
+  if(w->async)
+    w->running = pthread_create(&w->thread, NULL, writer_thread, w) == 0;
+  return 0;
+}
+
+/* Writes directly or queues a copy for the background thread */
+static int writer_append(file_writer *w, const void *data, size_t len){
+  if(len == 0)
+    return 0;
+  if(!w->running)
+    return write_chunk(w, data, len);
+  chunk *next = malloc(sizeof(chunk) + len);
+  if(next == NULL)
+    return ENOMEM;
+  next->next = NULL;
+  next->len = len;
+  memcpy(next->data, data, len);
+  pthread_mutex_lock(&w->lock);
+  while(w->pending > MAX_PENDING_BYTES)
+    pthread_cond_wait(&w->cond, &w->lock);
+  if(w->tail)
+    w->tail->next = next;
+  else
+    w->head = next;
+  w->tail = next;
+  w->pending += len;
+  int err = w->error;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  return err;
+}
+
+/* Close the file (after pending writes have completed) and returns the first error */
+static int writer_finish(file_writer *w){
+  if(w->running){
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    w->running = 0;
+    w->closing = 0;
+    total_open_writers--;
+  } else if(w->fp != NULL){
+    close_file(w);
+    total_open_writers--;
+  }
+  int err = w->error;
+  w->error = 0;
+  return err;
+}
+
+static file_writer *writer_alloc(size_t bufsize, double size, int async){
+  file_writer *w = calloc(1, sizeof(file_writer));
+  if(w == NULL)
+    return NULL;
+  w->bufsize = bufsize;
+  w->size = size;
+  w->async = async;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  return w;
+}
+
+static void writer_free(file_writer *w){
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  free(w->buffer);
+  free(w);
+}
+
+/* C interface: open a writer for a single file; returns NULL and sets 'err' on failure */
+file_writer *writer_create(const char *path, size_t bufsize, double size, int async, int *err){
+  file_writer *w = writer_alloc(bufsize, size, async);
+  *err = w ? writer_open(w, path) : ENOMEM;
+  if(*err && w){
+    writer_free(w);
+    w = NULL;
+  }
+  return w;
+}
+
+int writer_write(file_writer *w, const void *data, size_t len){
+  return writer_append(w, data, len);
+}
+
+/* Waits for pending writes, closes the file and frees the writer */
+int writer_close(file_writer *w){
+  int err = writer_finish(w);
+  writer_free(w);
+  return err;
+}
+
 static void fin_file_writer(SEXP ptr){
-  FILE *fp = R_ExternalPtrAddr(ptr);
-  if(fp != NULL){
-    fclose(fp);
+  file_writer *w = R_ExternalPtrAddr(ptr);
+  if(w != NULL){
+    writer_close(w);
     R_ClearExternalPtr(ptr);
-    total_open_writers--;
   }
 }
 
+static file_writer *get_writer(SEXP ptr){
+  file_writer *w = R_ExternalPtrAddr(ptr);
+  if(w == NULL)
+    Rf_error("File writer has been destroyed");
+  return w;
+}
+
+static void assert_write(file_writer *w, int err, SEXP ptr){
+  if(err)
+    Rf_error("Failed to write file %s: %s", CHAR(STRING_ELT(R_ExternalPtrTag(ptr), 0)), strerror(err));
+}
+
 SEXP R_ssh_write_file_writer(SEXP ptr, SEXP buf, SEXP close){
-  FILE *fp = R_ExternalPtrAddr(ptr);
-  if(fp == NULL){
-    SEXP path = R_ExternalPtrTag(ptr);
-    fp = fopen(CHAR(STRING_ELT(path, 0)), "wb");
-    if(!fp)
-      Rf_error("Failed to open file: %s", CHAR(STRING_ELT(path, 0)));
-    R_SetExternalPtrAddr(ptr, fp);
-    total_open_writers++;
+  file_writer *w = get_writer(ptr);
+
+  /* previous async close may still be in progress */
+  if(w->running && w->closing)
+    assert_write(w, writer_finish(w), ptr);
+  if(w->fp == NULL && !w->running){
+    const char *path = CHAR(STRING_ELT(R_ExternalPtrTag(ptr), 0));
+    if(writer_open(w, path))
+      Rf_error("Failed to open file: %s", path);
+  }
+  size_t len = Rf_xlength(buf);
+  int err = writer_append(w, RAW(buf), len);
+  if(err){
+    writer_finish(w);
+    assert_write(w, err, ptr);
   }
-  size_t len = fwrite(RAW(buf), 1, Rf_xlength(buf), fp);
   if(Rf_asLogical(close)){
-    fin_file_writer(ptr);
-  } else if(Rf_length(buf)) {
-    fflush(fp);
+    if(w->running){
+      /* background thread closes the file when it is done writing */
+      pthread_mutex_lock(&w->lock);
+      w->closing = 1;
+      pthread_cond_broadcast(&w->cond);
+      pthread_mutex_unlock(&w->lock);
+    } else {
+      assert_write(w, writer_finish(w), ptr);
+    }
   }
   return Rf_ScalarInteger(len);
 }
 
-SEXP R_ssh_new_file_writer(SEXP path){
-  SEXP ptr = PROTECT(R_MakeExternalPtr(NULL, path, R_NilValue));
+SEXP R_ssh_wait_file_writer(SEXP ptr){
+  file_writer *w = get_writer(ptr);
+  assert_write(w, writer_finish(w), ptr);
+  return Rf_ScalarLogical(TRUE);
+}
+
+SEXP R_ssh_new_file_writer(SEXP path, SEXP bufsize, SEXP size, SEXP async){
+  file_writer *w = writer_alloc(Rf_asInteger(bufsize), Rf_asReal(size), Rf_asLogical(async) == TRUE);
+  if(w == NULL)
+    Rf_error("Failed to allocate file writer");
+  SEXP ptr = PROTECT(R_MakeExternalPtr(w, path, R_NilValue));
   R_RegisterCFinalizerEx(ptr, fin_file_writer, TRUE);
   Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("file_writer"));
   UNPROTECT(1);